@@ -0,0 +1,438 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Maxime Chevallier
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file talks ATT directly over an L2CAP LE socket, without bluetoothd.
+ * We only do the minimal GATT discovery needed to find the key press
+ * characteristic and its CCCD, then read the notifications from the socket.
+ */
+
+#include "att-client.h"
+#include "uhid.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/* From the kernel bluetooth headers, so that we don't depend on libbluetooth */
+#define BTPROTO_L2CAP       0
+#define BDADDR_LE_PUBLIC    0x01
+#define ATT_CID             4
+
+struct att_sockaddr_l2 {
+    sa_family_t l2_family;
+    uint16_t    l2_psm;
+    uint8_t     l2_bdaddr[6];
+    uint16_t    l2_cid;
+    uint8_t     l2_bdaddr_type;
+};
+
+#define ATT_OP_ERROR_RSP            0x01
+#define ATT_OP_FIND_INFO_REQ        0x04
+#define ATT_OP_FIND_INFO_RSP        0x05
+#define ATT_OP_FIND_BY_TYPE_REQ     0x06
+#define ATT_OP_FIND_BY_TYPE_RSP     0x07
+#define ATT_OP_READ_BY_TYPE_REQ     0x08
+#define ATT_OP_READ_BY_TYPE_RSP     0x09
+#define ATT_OP_WRITE_REQ            0x12
+#define ATT_OP_WRITE_RSP            0x13
+#define ATT_OP_NOTIFY               0x1b
+
+#define ATT_ECODE_ATTR_NOT_FOUND    0x0a
+
+/* Default LE ATT MTU, we don't negotiate a bigger one */
+#define ATT_DEFAULT_MTU     23
+#define ATT_TIMEOUT_MS      5000
+#define ATT_RECONNECT_S     1
+
+#define GATT_PRIM_SVC_UUID  0x2800
+#define GATT_CHARAC_UUID    0x2803
+#define GATT_CCCD_UUID      0x2902
+
+#define KEY_PRESS_SVC       0xffe0
+#define KEY_PRESS_CHAR_DATA 0xffe1
+
+static int att_fd = -1;
+static guint att_watch_id = 0;
+static guint att_reconnect_id = 0;
+static gchar *att_address = NULL;
+static uint16_t key_value_handle = 0;
+
+static gboolean att_reconnect(gpointer user_data);
+
+static void put_le16(uint8_t *buf, uint16_t val) {
+    buf[0] = val & 0xff;
+    buf[1] = val >> 8;
+}
+
+static uint16_t get_le16(const uint8_t *buf) {
+    return buf[0] | (buf[1] << 8);
+}
+
+/** ----------------------------------------------------------------------------
+ * Sends a request and waits for its response. Notifications received in the
+ * meantime are dropped, we don't listen to anything yet.
+ * Returns the response length, -ENOENT if the server answered "attribute not
+ * found", another negative errno else.
+ */
+static int att_request(int fd, const uint8_t *req, size_t req_len,
+                       uint8_t rsp_op, uint8_t *rsp, size_t rsp_size) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    ssize_t len;
+
+    if (write(fd, req, req_len) != (ssize_t)req_len) {
+        printf("Cannot send ATT request 0x%02x : %m\n", req[0]);
+        return -EIO;
+    }
+
+    for (;;) {
+        if (poll(&pfd, 1, ATT_TIMEOUT_MS) <= 0) {
+            printf("No response to ATT request 0x%02x\n", req[0]);
+            return -ETIMEDOUT;
+        }
+
+        len = read(fd, rsp, rsp_size);
+        if (len <= 0) {
+            printf("Cannot read ATT response : %m\n");
+            return -EIO;
+        }
+
+        if (rsp[0] == rsp_op)
+            return len;
+
+        if (rsp[0] == ATT_OP_ERROR_RSP && len >= 5 && rsp[1] == req[0]) {
+            if (rsp[4] == ATT_ECODE_ATTR_NOT_FOUND)
+                return -ENOENT;
+            printf("ATT request 0x%02x failed : 0x%02x\n", req[0], rsp[4]);
+            return -EPROTO;
+        }
+    }
+}
+
+static gboolean att_find_service(int fd, uint16_t uuid, uint16_t *start,
+                                 uint16_t *end) {
+    uint8_t req[9], rsp[ATT_DEFAULT_MTU];
+    int len;
+
+    req[0] = ATT_OP_FIND_BY_TYPE_REQ;
+    put_le16(&req[1], 0x0001);
+    put_le16(&req[3], 0xffff);
+    put_le16(&req[5], GATT_PRIM_SVC_UUID);
+    put_le16(&req[7], uuid);
+
+    len = att_request(fd, req, sizeof(req), ATT_OP_FIND_BY_TYPE_RSP,
+                      rsp, sizeof(rsp));
+    if (len < 5)
+        return FALSE;
+
+    *start = get_le16(&rsp[1]);
+    *end = get_le16(&rsp[3]);
+
+    return TRUE;
+}
+
+/* Returns the value handle of the characteristic, 0 if not found */
+static uint16_t att_find_charac(int fd, uint16_t start, uint16_t end,
+                                uint16_t uuid) {
+    uint8_t req[7], rsp[ATT_DEFAULT_MTU];
+    int len, i, elem_len;
+
+    while (start <= end) {
+        req[0] = ATT_OP_READ_BY_TYPE_REQ;
+        put_le16(&req[1], start);
+        put_le16(&req[3], end);
+        put_le16(&req[5], GATT_CHARAC_UUID);
+
+        len = att_request(fd, req, sizeof(req), ATT_OP_READ_BY_TYPE_RSP,
+                          rsp, sizeof(rsp));
+        if (len < 2)
+            return 0;
+
+        /* Each elem : decl handle, properties, value handle, UUID */
+        elem_len = rsp[1];
+        if (elem_len < 7 || len < 2 + elem_len)
+            return 0;
+
+        for (i = 2; i + elem_len <= len; i += elem_len) {
+            /* 128 bits UUIDs are never the 16 bits one we look for */
+            if (elem_len == 7 && get_le16(&rsp[i + 5]) == uuid)
+                return get_le16(&rsp[i + 3]);
+
+            start = get_le16(&rsp[i]) + 1;
+        }
+
+        if (start == 0)
+            break;
+    }
+
+    return 0;
+}
+
+/* Returns the CCCD handle following the value handle, 0 if not found */
+static uint16_t att_find_cccd(int fd, uint16_t start, uint16_t end) {
+    uint8_t req[5], rsp[ATT_DEFAULT_MTU];
+    uint16_t handle, uuid;
+    int len, i;
+
+    while (start <= end) {
+        req[0] = ATT_OP_FIND_INFO_REQ;
+        put_le16(&req[1], start);
+        put_le16(&req[3], end);
+
+        len = att_request(fd, req, sizeof(req), ATT_OP_FIND_INFO_RSP,
+                          rsp, sizeof(rsp));
+        /* Format 0x01 is handle + 16 bits UUID, we don't care about the
+         * 128 bits ones */
+        if (len < 2)
+            return 0;
+
+        for (i = 2; i + 4 <= len && rsp[1] == 0x01; i += 4) {
+            handle = get_le16(&rsp[i]);
+            uuid = get_le16(&rsp[i + 2]);
+
+            if (uuid == GATT_CCCD_UUID)
+                return handle;
+            /* Next characteristic, this one has no CCCD */
+            if (uuid == GATT_CHARAC_UUID)
+                return 0;
+        }
+
+        if (rsp[1] != 0x01 || len < 6)
+            return 0;
+
+        start = get_le16(&rsp[len - 4]) + 1;
+        if (start == 0)
+            break;
+    }
+
+    return 0;
+}
+
+static gboolean att_enable_notify(int fd, uint16_t cccd) {
+    uint8_t req[5], rsp[ATT_DEFAULT_MTU];
+
+    req[0] = ATT_OP_WRITE_REQ;
+    put_le16(&req[1], cccd);
+    put_le16(&req[3], 0x0001);
+
+    return att_request(fd, req, sizeof(req), ATT_OP_WRITE_RSP,
+                       rsp, sizeof(rsp)) > 0;
+}
+
+/* Called from the watch, which gets removed by returning FALSE */
+static gboolean att_link_lost(void) {
+    printf("ATT link lost\n");
+
+    att_watch_id = 0;
+    close(att_fd);
+    att_fd = -1;
+    key_value_handle = 0;
+
+    /* Don't leave a button pressed */
+    uhid_event(FALSE, FALSE);
+
+    if (att_address) {
+        printf("Reconnecting to %s...\n", att_address);
+        att_reconnect_id = g_timeout_add_seconds(ATT_RECONNECT_S,
+                                                 att_reconnect, NULL);
+    }
+
+    return FALSE;
+}
+
+static gboolean on_att_event(GIOChannel *channel, GIOCondition cond,
+                             gpointer user_data) {
+    uint8_t pdu[ATT_DEFAULT_MTU];
+    ssize_t len;
+    uint8_t evt;
+
+    /* Read what is pending before handling a hang up */
+    if (!(cond & G_IO_IN))
+        return att_link_lost();
+
+    len = read(att_fd, pdu, sizeof(pdu));
+    if (len < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return TRUE;
+        printf("Cannot read ATT socket : %m\n");
+        return att_link_lost();
+    } else if (len == 0) {
+        return att_link_lost();
+    }
+
+    if (len < 3 || pdu[0] != ATT_OP_NOTIFY ||
+        get_le16(&pdu[1]) != key_value_handle)
+        return TRUE;
+
+    if (len != 4) {
+        printf("Unexpected number of elems ( %zd )\n", len - 3);
+        return TRUE;
+    }
+
+    evt = pdu[3];
+    uhid_event(!!(evt & 0x01), !!(evt & 0x02));
+
+    return TRUE;
+}
+
+gboolean att_setup_fd(int fd) {
+    uint16_t svc_start, svc_end, cccd;
+    GIOChannel *channel;
+
+    if (!att_find_service(fd, KEY_PRESS_SVC, &svc_start, &svc_end)) {
+        printf("No key pressed service found\n");
+        return FALSE;
+    }
+
+    key_value_handle = att_find_charac(fd, svc_start, svc_end,
+                                       KEY_PRESS_CHAR_DATA);
+    if (!key_value_handle) {
+        printf("No key pressed characteristic found\n");
+        return FALSE;
+    }
+    printf("Found key pressed characteristic : handle 0x%04x\n",
+           key_value_handle);
+
+    cccd = att_find_cccd(fd, key_value_handle + 1, svc_end);
+    if (!cccd) {
+        printf("No CCCD for the key pressed characteristic\n");
+        return FALSE;
+    }
+
+    if (!att_enable_notify(fd, cccd)) {
+        printf("Cannot enable key press notifications\n");
+        return FALSE;
+    }
+    printf("Started notifications on handle 0x%04x\n", key_value_handle);
+
+    att_fd = fd;
+
+    channel = g_io_channel_unix_new(fd);
+    att_watch_id = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                  on_att_event, NULL);
+    g_io_channel_unref(channel);
+
+    return TRUE;
+}
+
+static gboolean att_parse_address(const gchar *address, uint8_t *bdaddr) {
+    unsigned int b[6];
+    int i;
+
+    if (sscanf(address, "%02x:%02x:%02x:%02x:%02x:%02x",
+               &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+        return FALSE;
+
+    /* bdaddr_t is little endian */
+    for (i = 0; i < 6; i++)
+        bdaddr[i] = b[5 - i];
+
+    return TRUE;
+}
+
+static int att_connect(const gchar *address) {
+    struct att_sockaddr_l2 addr;
+    int fd;
+
+    fd = socket(AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_CLOEXEC, BTPROTO_L2CAP);
+    if (fd < 0) {
+        printf("Cannot create L2CAP socket : %m\n");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.l2_family = AF_BLUETOOTH;
+    addr.l2_cid = ATT_CID;
+    addr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        printf("Cannot bind L2CAP socket : %m\n");
+        close(fd);
+        return -1;
+    }
+
+    if (!att_parse_address(address, addr.l2_bdaddr)) {
+        printf("Invalid address %s\n", address);
+        close(fd);
+        return -1;
+    }
+
+    printf("Connecting to %s...\n", address);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        printf("Cannot connect to %s : %m\n", address);
+        close(fd);
+        return -1;
+    }
+
+    if (!att_setup_fd(fd)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static gboolean att_reconnect(gpointer user_data) {
+    if (att_connect(att_address) < 0)
+        return G_SOURCE_CONTINUE;
+
+    att_reconnect_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+gboolean att_setup(const gchar *address) {
+    if (att_connect(address) < 0)
+        return FALSE;
+
+    /* Kept to reconnect when the link is lost */
+    g_free(att_address);
+    att_address = g_strdup(address);
+
+    return TRUE;
+}
+
+void att_cleanup(void) {
+    if (att_reconnect_id) {
+        g_source_remove(att_reconnect_id);
+        att_reconnect_id = 0;
+    }
+
+    if (att_watch_id) {
+        g_source_remove(att_watch_id);
+        att_watch_id = 0;
+    }
+
+    /* Closing the socket drops the link, no need to disable notifications */
+    if (att_fd >= 0) {
+        close(att_fd);
+        att_fd = -1;
+    }
+
+    key_value_handle = 0;
+
+    g_free(att_address);
+    att_address = NULL;
+}
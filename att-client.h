@@ -0,0 +1,42 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Maxime Chevallier
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef __ATT_CLIENT_H__
+#define __ATT_CLIENT_H__
+
+#include <glib.h>
+
+/* Opens an ATT channel to the sensortag at the given address
+ * ( "XX:XX:XX:XX:XX:XX" ) and sets up key press notifications on it.
+ * If the link is lost later on, we keep trying to reconnect. */
+gboolean att_setup(const gchar *address);
+
+/* Same as att_setup, on an already connected ATT bearer. Any SOCK_SEQPACKET
+ * socket speaking ATT PDUs will do, not only an L2CAP one. */
+gboolean att_setup_fd(int fd);
+
+void att_cleanup(void);
+
+#endif
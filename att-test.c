@@ -0,0 +1,222 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Maxime Chevallier
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Tests the ATT client against a stand-in ATT server, over a socketpair.
+ * The server exposes a key press service laid out as follows :
+ *
+ *  0x0020 : primary service 0xffe0, ends at 0x0030
+ *  0x0021 : characteristic 0x2a01, value 0x0022
+ *  0x0024 : characteristic 0xffe2, value 0x0025
+ *  0x0027 : characteristic 0xffe1, value 0x0028
+ *  0x0029 : CCCD
+ *
+ * Characteristics are returned 2 at a time so that the client has to
+ * paginate, and a notification for another handle is sent before each
+ * response.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <glib.h>
+
+#include "att-client.h"
+#include "uhid.h"
+
+#define KEY_VALUE_HANDLE    0x0028
+#define KEY_CCCD_HANDLE     0x0029
+
+static int nb_events = 0;
+static gboolean last_left = FALSE, last_right = FALSE;
+
+/* The test links att-client.o alone, this replaces the uhid output */
+gboolean uhid_event(gboolean left_down, gboolean right_down) {
+    nb_events++;
+    last_left = left_down;
+    last_right = right_down;
+    return TRUE;
+}
+
+static void server_send(int fd, const uint8_t *pdu, size_t len) {
+    if (write(fd, pdu, len) != (ssize_t)len)
+        _exit(2);
+}
+
+static void server_error(int fd, uint8_t req_op, uint16_t handle) {
+    uint8_t rsp[] = { 0x01, req_op, handle & 0xff, handle >> 8, 0x0a };
+
+    server_send(fd, rsp, sizeof(rsp));
+}
+
+/* Returns when the CCCD got written, exits with an error code if the client
+ * did something unexpected */
+static void server_discovery(int fd) {
+    static const uint8_t stray[] = { 0x1b, 0x99, 0x00, 0x01 };
+    uint8_t req[32];
+    uint16_t start;
+    ssize_t len;
+
+    for (;;) {
+        len = read(fd, req, sizeof(req));
+        if (len <= 0)
+            _exit(3);
+
+        server_send(fd, stray, sizeof(stray));
+
+        switch (req[0]) {
+        case 0x06: { /* Find By Type Value : primary service 0xffe0 */
+            uint8_t rsp[] = { 0x07, 0x20, 0x00, 0x30, 0x00 };
+
+            if (len != 9 || req[5] != 0x00 || req[6] != 0x28 ||
+                req[7] != 0xe0 || req[8] != 0xff)
+                _exit(4);
+            server_send(fd, rsp, sizeof(rsp));
+            break;
+        }
+        case 0x08: /* Read By Type : characteristics */
+            start = req[1] | (req[2] << 8);
+            if (start <= 0x0021) {
+                uint8_t rsp[] = { 0x09, 7,
+                                  0x21, 0x00, 0x10, 0x22, 0x00, 0x01, 0x2a,
+                                  0x24, 0x00, 0x10, 0x25, 0x00, 0xe2, 0xff };
+                server_send(fd, rsp, sizeof(rsp));
+            } else if (start <= 0x0027) {
+                uint8_t rsp[] = { 0x09, 7,
+                                  0x27, 0x00, 0x10, 0x28, 0x00, 0xe1, 0xff };
+                server_send(fd, rsp, sizeof(rsp));
+            } else {
+                server_error(fd, req[0], start);
+            }
+            break;
+        case 0x04: { /* Find Information, after the value handle */
+            uint8_t rsp[] = { 0x05, 0x01, 0x29, 0x00, 0x02, 0x29 };
+
+            start = req[1] | (req[2] << 8);
+            if (start != KEY_VALUE_HANDLE + 1)
+                _exit(5);
+            server_send(fd, rsp, sizeof(rsp));
+            break;
+        }
+        case 0x12: { /* Write : must enable notifications on the CCCD */
+            uint8_t rsp[] = { 0x13 };
+
+            if (len != 5 || (req[1] | (req[2] << 8)) != KEY_CCCD_HANDLE ||
+                req[3] != 0x01 || req[4] != 0x00)
+                _exit(6);
+            server_send(fd, rsp, sizeof(rsp));
+            return;
+        }
+        default:
+            server_error(fd, req[0], 0);
+            break;
+        }
+    }
+}
+
+static void server(int fd) {
+    static const uint8_t other[] = { 0x1b, 0x25, 0x00, 0x03 };
+    static const uint8_t both[] = { 0x1b, 0x28, 0x00, 0x03 };
+    static const uint8_t released[] = { 0x1b, 0x28, 0x00, 0x00 };
+
+    server_discovery(fd);
+
+    /* Notification on another characteristic, must be ignored */
+    server_send(fd, other, sizeof(other));
+    server_send(fd, both, sizeof(both));
+    server_send(fd, released, sizeof(released));
+
+    close(fd);
+    _exit(0);
+}
+
+static gboolean on_timeout(gpointer user_data) {
+    gboolean *timed_out = user_data;
+
+    *timed_out = TRUE;
+    return G_SOURCE_REMOVE;
+}
+
+int main(int argc, char **argv) {
+    gboolean timed_out = FALSE;
+    int sv[2], status;
+    int ret = 0;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+        printf("Cannot create socketpair\n");
+        return 1;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        printf("Cannot fork\n");
+        return 1;
+    } else if (pid == 0) {
+        close(sv[0]);
+        server(sv[1]);
+    }
+    close(sv[1]);
+
+    if (!att_setup_fd(sv[0])) {
+        printf("FAIL : discovery\n");
+        /* The client did not take the socket, hang up ourselves or the
+         * server never returns from its read */
+        close(sv[0]);
+        ret = 1;
+        goto out;
+    }
+
+    /* 2 key events, then the release sent when the server hangs up */
+    g_timeout_add_seconds(5, on_timeout, &timed_out);
+    while (nb_events < 3 && !timed_out) {
+        g_main_context_iteration(NULL, TRUE);
+
+        if (nb_events == 1 && (!last_left || !last_right)) {
+            printf("FAIL : expected both keys down\n");
+            ret = 1;
+            goto out;
+        }
+    }
+
+    if (nb_events != 3 || last_left || last_right) {
+        printf("FAIL : got %d key events\n", nb_events);
+        ret = 1;
+    }
+
+out:
+    att_cleanup();
+
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        printf("FAIL : ATT server exited with %d\n", WEXITSTATUS(status));
+        ret = 1;
+    }
+
+    if (!ret)
+        printf("PASS\n");
+
+    return ret;
+}
@@ -27,19 +27,112 @@
 
 #include "bluez-gatt-client.h"
 #include "uhid.h"
+#include "sensor-ring.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 #define KEY_PRESS_SVC       "0000ffe0-0000-1000-8000-00805f9b34fb"
 #define KEY_PRESS_CHAR_DATA "0000ffe1-0000-1000-8000-00805f9b34fb"
+/* The CC2650 firmware does not advertise the key press service, but the
+ * 16 bits UUID of the movement service */
+#define CC2650_ADV_SVC      "0000aa80-0000-1000-8000-00805f9b34fb"
+
+/* Sensor periods are in units of 10ms, as written in the period characteristics.
+ * Sensors run at full rate while the tag is being used ( key pressed recently )
+ * or while someone reads the sensor ring, at idle rate otherwise. */
+#define SCHED_INTERVAL_S        1
+#define SCHED_ACTIVE_TIMEOUT_NS (30 * 1000000000ULL)
+#define SCHED_READER_TIMEOUT_NS (5 * 1000000000ULL)
+/* Don't write periods right after a key press, let the key events go first */
+#define SCHED_KEY_QUIET_NS      (500 * 1000000ULL)
+#define SCHED_IDLE_PERIOD       255
+/* Sensor notifications per second allowed on an adapter. The key
+ * notifications are not accounted, this keeps room for them on the air. */
+#define SCHED_ADAPTER_BUDGET    8
+
+/* TI sensortag base UUID : f000XXXX-0451-4000-b000-000000000000 */
+#define TI_UUID(x) "f000" x "-0451-4000-b000-000000000000"
 
 static gchar *notification_charac = NULL;
 static gchar *notification_device_path = NULL;
 static gint key_pressed_sub_id = 0;
 
+static void decode_ir_temp(const uint8_t *raw, double *values);
+static void decode_humidity(const uint8_t *raw, double *values);
+static void decode_pressure(const uint8_t *raw, double *values);
+static void decode_light(const uint8_t *raw, double *values);
+
+struct sensor {
+    enum sensor_type type;
+    const gchar *name;
+    const gchar *data_uuid;
+    const gchar *config_uuid;
+    const gchar *period_uuid;
+    gsize data_len;
+    guint min_period;
+    void (*decode)(const uint8_t *raw, double *values);
+
+    /* Filled when the sensor is found on the device */
+    gchar *data_path;
+    gchar *config_path;
+    gchar *period_path;
+    gboolean notifying;
+    guint sub_id;
+    guint period;   /* Last written period, 0 if unknown */
+    guint pending_period;   /* Period being written, 0 if none */
+};
+
+/* Data formats are the CC2650 ones. The CC2541 uses the same UUIDs and data
+ * lengths for different chips, so the sensors are only enabled on tags having
+ * the light sensor, which only exists on the CC2650. */
+static struct sensor sensors[] = {
+    { SENSOR_IR_TEMP, "IR temperature",
+      TI_UUID("aa01"), TI_UUID("aa02"), TI_UUID("aa03"), 4, 30, decode_ir_temp },
+    { SENSOR_HUMIDITY, "humidity",
+      TI_UUID("aa21"), TI_UUID("aa22"), TI_UUID("aa23"), 4, 10, decode_humidity },
+    { SENSOR_PRESSURE, "pressure",
+      TI_UUID("aa41"), TI_UUID("aa42"), TI_UUID("aa44"), 6, 10, decode_pressure },
+    { SENSOR_LIGHT, "light",
+      TI_UUID("aa71"), TI_UUID("aa72"), TI_UUID("aa73"), 2, 10, decode_light },
+};
+
+/* Provisioning of new tags, see bluez_provision() */
+static gchar *provision_adapter = NULL;
+static GHashTable *provision_adopted = NULL;
+/* Adopted devices we issued Connect on, the only ones we disconnect */
+static GHashTable *provision_owned = NULL;
+/* Devices seen advertising one of the sensortag services */
+static GHashTable *provision_candidates = NULL;
+static guint provision_target = 0;
+static guint provision_connected = 0;
+static gboolean provision_discovering = FALSE;
+static guint provision_added_id = 0;
+static guint provision_props_id = 0;
+
+static struct sensor_ring *sensor_ring = NULL;
+static guint sched_id = 0;
+static uint64_t last_key_ns = 0;
+/* Bumped each time the sensors are cleaned up, period writes still in flight
+ * from before belong to another tag */
+static guint sensors_generation = 0;
+
+struct period_write {
+    struct sensor *sensor;
+    guint generation;
+    guint period;
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
 static GVariant *bluez_get_objects(GDBusConnection *connection) {
     GError *error = NULL;
     GVariant *objects;
@@ -71,7 +164,6 @@ static gboolean bluez_start_notify(GDBusConnection *connection,
         printf("Cannot start notify on charac %s : %s\n", charac, error->message);
         g_error_free(error);
     } else {
-        notification_charac = g_strdup(charac);
         ret = TRUE;
         printf("Started notifications on %s\n", charac);
     }
@@ -101,6 +193,79 @@ static gboolean bluez_stop_notify(GDBusConnection *connection,
 
 }
 
+static gboolean bluez_write_value(GDBusConnection *connection,
+                                  const gchar *charac, const uint8_t *value,
+                                  gsize len) {
+    GError *error = NULL;
+    GVariant *array = g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, value,
+                                                len, sizeof(uint8_t));
+
+    g_dbus_connection_call_sync(connection, "org.bluez", charac,
+                                "org.bluez.GattCharacteristic1", "WriteValue",
+                                g_variant_new("(@aya{sv})", array, NULL),
+                                NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+
+    if (error) {
+        printf("Cannot write charac %s : %s\n", charac, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void on_period_written(GObject *source, GAsyncResult *res,
+                              gpointer user_data) {
+    struct period_write *req = user_data;
+    struct sensor *sensor = req->sensor;
+    GError *error = NULL;
+    GVariant *ret;
+
+    ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    if (ret)
+        g_variant_unref(ret);
+
+    /* The sensors were cleaned up in the meantime, and maybe set up again on
+     * another tag : this write is none of their business */
+    if (req->generation != sensors_generation) {
+        if (error)
+            g_error_free(error);
+        g_free(req);
+        return;
+    }
+
+    if (error) {
+        printf("Cannot write %s period : %s\n", sensor->name, error->message);
+        g_error_free(error);
+    } else {
+        printf("%s period set to %d ms\n", sensor->name, req->period * 10);
+        sensor->period = req->period;
+    }
+
+    sensor->pending_period = 0;
+    g_free(req);
+}
+
+/* Asynchronous, so that the mainloop keeps delivering key events while the
+ * write goes over the air */
+static void bluez_write_period(GDBusConnection *connection,
+                               struct sensor *sensor, uint8_t period) {
+    GVariant *array = g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, &period,
+                                                1, sizeof(uint8_t));
+    struct period_write *req = g_new0(struct period_write, 1);
+
+    req->sensor = sensor;
+    req->generation = sensors_generation;
+    req->period = period;
+
+    sensor->pending_period = period;
+    g_dbus_connection_call(connection, "org.bluez", sensor->period_path,
+                           "org.bluez.GattCharacteristic1", "WriteValue",
+                           g_variant_new("(@aya{sv})", array, NULL),
+                           NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                           on_period_written, req);
+}
+
 static void key_event_cb(uint8_t evt) {
     int left_down = 0, right_down = 0;
 
@@ -109,6 +274,8 @@ static void key_event_cb(uint8_t evt) {
     if (evt & 0x02)
         right_down = 1;
 
+    last_key_ns = monotonic_ns();
+
     uhid_event(left_down, right_down);
 }
 
@@ -143,10 +310,90 @@ static void on_key_pressed(GDBusConnection *connection,
 
 }
 
+static void decode_ir_temp(const uint8_t *raw, double *values) {
+    /* TMP007 : object then ambient, signed 14 bits left aligned,
+     * 0.03125 °C/LSB */
+    int16_t obj = raw[0] | (raw[1] << 8);
+    int16_t amb = raw[2] | (raw[3] << 8);
+
+    values[0] = (obj >> 2) * 0.03125;
+    values[1] = (amb >> 2) * 0.03125;
+}
+
+static void decode_humidity(const uint8_t *raw, double *values) {
+    /* HDC1000 : temperature then humidity */
+    uint16_t temp = raw[0] | (raw[1] << 8);
+    uint16_t hum = raw[2] | (raw[3] << 8);
+
+    values[0] = (temp / 65536.0) * 165.0 - 40.0;
+    values[1] = (hum / 65536.0) * 100.0;
+}
+
+static void decode_pressure(const uint8_t *raw, double *values) {
+    /* BMP280 : 24 bits signed temperature then pressure, in 1/100 units.
+     * The temperature is loaded in the top 24 bits to sign extend it. */
+    int32_t temp = (int32_t)((uint32_t)raw[0] << 8 | (uint32_t)raw[1] << 16 |
+                             (uint32_t)raw[2] << 24) >> 8;
+    uint32_t press = raw[3] | (raw[4] << 8) | (raw[5] << 16);
+
+    values[0] = temp / 100.0;
+    values[1] = press / 100.0;
+}
+
+static void decode_light(const uint8_t *raw, double *values) {
+    /* OPT3001 : 4 bits exponent, 12 bits mantissa */
+    uint16_t val = raw[0] | (raw[1] << 8);
+    uint16_t m = val & 0x0fff;
+    uint16_t e = (val & 0xf000) >> 12;
+
+    values[0] = m * (0.01 * (1 << e));
+    values[1] = 0;
+}
+
+static void on_sensor_data(GDBusConnection *connection,
+                           const gchar *sender_name,
+                           const gchar *object_path,
+                           const gchar *interface_name,
+                           const gchar *signal_name, GVariant *parameters,
+                           gpointer user_data) {
+
+    struct sensor *sensor = user_data;
+    GVariant *arr_prop = g_variant_get_child_value(parameters, 1);
+    struct sensor_sample sample;
+
+    GVariantIter prop_iter;
+    GVariant *prop_val;
+    gchar *prop_name;
+    const uint8_t *byte_array;
+    gsize nb_elems;
+
+    g_variant_iter_init(&prop_iter, arr_prop);
+    while (g_variant_iter_loop(&prop_iter, "{sv}", &prop_name, &prop_val)) {
+
+        if (g_strcmp0(prop_name, "Value"))
+            continue;
+
+        byte_array = g_variant_get_fixed_array(prop_val, &nb_elems, sizeof(uint8_t));
+        if (nb_elems != sensor->data_len || !sensor_ring)
+            continue;
+
+        memset(&sample, 0, sizeof(sample));
+        sample.timestamp_ns = monotonic_ns();
+        sample.type = sensor->type;
+        sample.device = 0;
+        sensor->decode(byte_array, sample.values);
+
+        sensor_ring_publish(sensor_ring, &sample);
+    }
+
+    g_variant_unref(arr_prop);
+}
+
 static gboolean bluez_setup_gatt_client(GDBusConnection *connection,
                                                 gchar *charac_path) {
 
     if (bluez_start_notify(connection, charac_path)) {
+        notification_charac = g_strdup(charac_path);
         key_pressed_sub_id = g_dbus_connection_signal_subscribe(connection,
                                                             "org.bluez",
                                                             "org.freedesktop.DBus.Properties",
@@ -289,9 +536,213 @@ static gboolean bluez_device_disconnect(GDBusConnection *connection,
     return ret;
 
 }
-static gboolean bluez_setup_init(GDBusConnection *connection) {
+
+/** ----------------------------------------------------------------------------
+ * Looks for the sensor characteristics belonging to the given device.
+ * root_elem is the a{oa{sa{sv}}} returned by GetManagedObjects.
+ */
+static void bluez_find_sensors(GVariant *root_elem, const gchar *device_path) {
+    gchar *prefix = g_strconcat(device_path, "/", NULL);
+    GVariantIter obj_iter;
+    GVariant *ifaces;
+    gchar *path;
+    guint i;
+
+    g_variant_iter_init(&obj_iter, root_elem);
+    while (g_variant_iter_loop(&obj_iter, "{o@a{sa{sv}}}", &path, &ifaces)) {
+        if (!g_str_has_prefix(path, prefix))
+            continue;
+
+        for (i = 0; i < G_N_ELEMENTS(sensors); i++) {
+            struct sensor *sensor = &sensors[i];
+
+            if (!sensor->data_path && bluez_obj_has_UUID(ifaces, sensor->data_uuid))
+                sensor->data_path = g_strdup(path);
+            else if (!sensor->config_path && bluez_obj_has_UUID(ifaces, sensor->config_uuid))
+                sensor->config_path = g_strdup(path);
+            else if (!sensor->period_path && bluez_obj_has_UUID(ifaces, sensor->period_uuid))
+                sensor->period_path = g_strdup(path);
+        }
+    }
+
+    g_free(prefix);
+}
+
+/** ----------------------------------------------------------------------------
+ * Returns the period a sensor should run at. The adapter budget is shared
+ * evenly between the notifying sensors, but a sensor never goes faster than
+ * its own minimal period.
+ */
+static guint bluez_sched_period(const struct sensor *sensor, gboolean busy,
+                                guint nb_notifying) {
+    guint period;
+
+    if (!busy)
+        return SCHED_IDLE_PERIOD;
+
+    /* nb_notifying / budget seconds, in 10ms units */
+    period = (100 * nb_notifying) / SCHED_ADAPTER_BUDGET;
+
+    if (period < sensor->min_period)
+        period = sensor->min_period;
+    if (period > SCHED_IDLE_PERIOD)
+        period = SCHED_IDLE_PERIOD;
+
+    return period;
+}
+
+static gboolean bluez_sched_cb(gpointer user_data) {
+    GDBusConnection *connection = user_data;
+    uint64_t now = monotonic_ns();
+    uint64_t reader_ns = sensor_ring ? sensor_ring_reader_ns(sensor_ring) : 0;
+    gboolean busy = FALSE;
+    guint nb_notifying = 0;
+    guint i;
+
+    if (last_key_ns && now - last_key_ns < SCHED_KEY_QUIET_NS)
+        return G_SOURCE_CONTINUE;
+
+    if (last_key_ns && now - last_key_ns < SCHED_ACTIVE_TIMEOUT_NS)
+        busy = TRUE;
+    if (reader_ns && now - reader_ns < SCHED_READER_TIMEOUT_NS)
+        busy = TRUE;
+
+    /* We only drive one tag for now, so it owns the whole adapter budget */
+    for (i = 0; i < G_N_ELEMENTS(sensors); i++)
+        if (sensors[i].notifying && sensors[i].period_path)
+            nb_notifying++;
+
+    for (i = 0; i < G_N_ELEMENTS(sensors); i++) {
+        struct sensor *sensor = &sensors[i];
+        uint8_t period;
+
+        if (!sensor->notifying || !sensor->period_path)
+            continue;
+
+        /* Wait for the previous write to complete */
+        if (sensor->pending_period)
+            continue;
+
+        period = bluez_sched_period(sensor, busy, nb_notifying);
+        if (period == sensor->period)
+            continue;
+
+        bluez_write_period(connection, sensor, period);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/** ----------------------------------------------------------------------------
+ * Enables the sensors found by bluez_find_sensors, and publishes their samples
+ * in the shared memory ring. Missing sensors are not an error, the key press
+ * events work without them.
+ */
+static void bluez_setup_sensors(GDBusConnection *connection) {
+    static const uint8_t enable = 0x01;
+    gboolean is_cc2650 = FALSE;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(sensors); i++)
+        if (sensors[i].type == SENSOR_LIGHT && sensors[i].data_path)
+            is_cc2650 = TRUE;
+
+    if (!is_cc2650) {
+        printf("Not a CC2650 sensortag, sensors disabled\n");
+        return;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(sensors); i++) {
+        struct sensor *sensor = &sensors[i];
+
+        if (!sensor->data_path || !sensor->config_path) {
+            printf("No %s sensor on this device\n", sensor->name);
+            continue;
+        }
+
+        if (!sensor_ring) {
+            sensor_ring = sensor_ring_create();
+            if (!sensor_ring) {
+                printf("Cannot create sensor ring, sensors disabled\n");
+                return;
+            }
+        }
+
+        if (!bluez_write_value(connection, sensor->config_path, &enable, 1))
+            continue;
+
+        if (!bluez_start_notify(connection, sensor->data_path))
+            continue;
+
+        sensor->notifying = TRUE;
+        sensor->sub_id = g_dbus_connection_signal_subscribe(connection,
+                                                            "org.bluez",
+                                                            "org.freedesktop.DBus.Properties",
+                                                            "PropertiesChanged",
+                                                            sensor->data_path,
+                                                            "org.bluez.GattCharacteristic1",
+                                                            G_DBUS_SIGNAL_FLAGS_NONE,
+                                                            on_sensor_data,
+                                                            sensor, NULL);
+        printf("Publishing %s samples from %s\n", sensor->name, sensor->data_path);
+    }
+
+    if (sensor_ring && !sched_id) {
+        bluez_sched_cb(connection);
+        sched_id = g_timeout_add_seconds(SCHED_INTERVAL_S, bluez_sched_cb,
+                                         connection);
+    }
+}
+
+static void bluez_cleanup_sensors(GDBusConnection *connection) {
+    static const uint8_t disable = 0x00;
+    guint i;
+
+    if (sched_id) {
+        g_source_remove(sched_id);
+        sched_id = 0;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(sensors); i++) {
+        struct sensor *sensor = &sensors[i];
+
+        if (sensor->sub_id) {
+            g_dbus_connection_signal_unsubscribe(connection, sensor->sub_id);
+            sensor->sub_id = 0;
+        }
+
+        if (sensor->notifying) {
+            bluez_stop_notify(connection, sensor->data_path);
+            bluez_write_value(connection, sensor->config_path, &disable, 1);
+            sensor->notifying = FALSE;
+        }
+
+        g_free(sensor->data_path);
+        g_free(sensor->config_path);
+        g_free(sensor->period_path);
+        sensor->period = 0;
+        sensor->pending_period = 0;
+        sensor->data_path = NULL;
+        sensor->config_path = NULL;
+        sensor->period_path = NULL;
+    }
+
+    sensors_generation++;
+
+    sensor_ring_destroy(sensor_ring);
+    sensor_ring = NULL;
+}
+
+/** ----------------------------------------------------------------------------
+ * Looks for the key press characteristic, and sets up the device it belongs
+ * to. If device_filter is not NULL, only the characteristics of this device
+ * are considered.
+ */
+static gboolean bluez_setup_init(GDBusConnection *connection,
+                                 const gchar *device_filter) {
     gchar *char_path = NULL;
     gchar *device_path = NULL;
+    gchar *prefix = NULL;
     GVariant *objects;
     gboolean res = TRUE;
 
@@ -325,8 +776,14 @@ static gboolean bluez_setup_init(GDBusConnection *connection) {
     GVariant *ifaces;
     gchar *path;
 
+    if (device_filter)
+        prefix = g_strconcat(device_filter, "/", NULL);
+
     g_variant_iter_init(&obj_iter, root_elem);
     while (g_variant_iter_loop(&obj_iter, "{o@a{sa{sv}}}", &path, &ifaces)) {
+        if (prefix && !g_str_has_prefix(path, prefix))
+            continue;
+
         if (bluez_obj_has_UUID(ifaces, KEY_PRESS_CHAR_DATA)) {
 
             /* We might want to add support for multiple devices as HID later */
@@ -341,6 +798,11 @@ static gboolean bluez_setup_init(GDBusConnection *connection) {
         }
     }
 
+    g_free(prefix);
+
+    if (device_path)
+        bluez_find_sensors(root_elem, device_path);
+
     g_variant_unref(root_elem);
     g_variant_unref(objects);
 
@@ -360,21 +822,401 @@ static gboolean bluez_setup_init(GDBusConnection *connection) {
         }
     }
 
+    g_free(notification_device_path);
     notification_device_path = device_path;
 
     if (res)
         res = bluez_setup_gatt_client(connection, char_path);
 
+    if (res)
+        bluez_setup_sensors(connection);
+    else
+        /* Forget this tag's sensors, the next attempt may be on another tag */
+        bluez_cleanup_sensors(connection);
+
     g_free(char_path);
 
     return res;
 }
 
+/** ----------------------------------------------------------------------------
+ * Provisioning : we run a LE discovery filtered on the services the tags
+ * advertise, and connect every tag that shows up. Once a tag has its services resolved, it
+ * is set up as if it had been found by bluez_setup().
+ */
+/* Services advertised by the tags, one of them is enough */
+static const gchar *provision_uuids[] = { KEY_PRESS_SVC, CC2650_ADV_SVC, NULL };
+
+/* Expects the UUIDs property ( "as" ) of a device */
+static gboolean bluez_uuids_are_sensortag(GVariant *uuids) {
+    const gchar **strv;
+    gboolean ret = FALSE;
+    guint i;
+
+    strv = g_variant_get_strv(uuids, NULL);
+    for (i = 0; provision_uuids[i] && !ret; i++)
+        ret = g_strv_contains(strv, provision_uuids[i]);
+    g_free(strv);
+
+    return ret;
+}
+
+static gboolean bluez_on_provision_adapter(const gchar *device_path) {
+    gsize len = strlen(provision_adapter);
+
+    return !strncmp(device_path, provision_adapter, len) &&
+           device_path[len] == '/';
+}
+
+/** ----------------------------------------------------------------------------
+ * Finds the adapter to provision on, and the tags it already knows about.
+ * The tags that are already connected don't advertise, they are counted as
+ * provisioned right away. Returns the path of a connected tag with its
+ * services resolved, if any.
+ */
+static gchar *bluez_provision_scan(GDBusConnection *connection) {
+    GVariant *objects, *root_elem, *ifaces, *iface, *uuids;
+    GVariantIter obj_iter;
+    gchar *resolved_path = NULL;
+    gboolean connected, resolved;
+    gchar *path;
+
+    objects = bluez_get_objects(connection);
+    if (!objects)
+        return NULL;
+
+    root_elem = g_variant_get_child_value(objects, 0);
+
+    g_variant_iter_init(&obj_iter, root_elem);
+    while (g_variant_iter_loop(&obj_iter, "{o@a{sa{sv}}}", &path, &ifaces)) {
+        iface = g_variant_lookup_value(ifaces, "org.bluez.Adapter1", NULL);
+        if (iface) {
+            g_variant_unref(iface);
+            if (!provision_adapter)
+                provision_adapter = g_strdup(path);
+        }
+    }
+
+    g_variant_iter_init(&obj_iter, root_elem);
+    while (provision_adapter &&
+           g_variant_iter_loop(&obj_iter, "{o@a{sa{sv}}}", &path, &ifaces)) {
+        if (!bluez_on_provision_adapter(path))
+            continue;
+
+        iface = g_variant_lookup_value(ifaces, "org.bluez.Device1", NULL);
+        if (!iface)
+            continue;
+
+        uuids = g_variant_lookup_value(iface, "UUIDs", G_VARIANT_TYPE("as"));
+        if (uuids && bluez_uuids_are_sensortag(uuids)) {
+            g_hash_table_add(provision_candidates, g_strdup(path));
+
+            connected = resolved = FALSE;
+            g_variant_lookup(iface, "Connected", "b", &connected);
+            g_variant_lookup(iface, "ServicesResolved", "b", &resolved);
+
+            if (connected) {
+                printf("%s is already connected\n", path);
+                g_hash_table_add(provision_adopted, g_strdup(path));
+                provision_connected++;
+                if (resolved && !resolved_path)
+                    resolved_path = g_strdup(path);
+            }
+        }
+
+        if (uuids)
+            g_variant_unref(uuids);
+        g_variant_unref(iface);
+    }
+
+    g_variant_unref(root_elem);
+    g_variant_unref(objects);
+
+    return resolved_path;
+}
+
+static gboolean bluez_adapter_call(GDBusConnection *connection,
+                                   const gchar *method, GVariant *params) {
+    GError *error = NULL;
+    GVariant *ret;
+
+    ret = g_dbus_connection_call_sync(connection, "org.bluez", provision_adapter,
+                                      "org.bluez.Adapter1", method, params,
+                                      NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                                      &error);
+    if (error) {
+        printf("%s failed on %s : %s\n", method, provision_adapter,
+                                            error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    g_variant_unref(ret);
+    return TRUE;
+}
+
+static gboolean bluez_start_discovery(GDBusConnection *connection) {
+    GVariantBuilder filter;
+
+    g_variant_builder_init(&filter, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&filter, "{sv}", "Transport",
+                          g_variant_new_string("le"));
+    g_variant_builder_add(&filter, "{sv}", "UUIDs",
+                          g_variant_new_strv(provision_uuids, -1));
+
+    if (!bluez_adapter_call(connection, "SetDiscoveryFilter",
+                            g_variant_new("(a{sv})", &filter)))
+        return FALSE;
+
+    if (!bluez_adapter_call(connection, "StartDiscovery", NULL))
+        return FALSE;
+
+    provision_discovering = TRUE;
+    printf("Started LE discovery on %s\n", provision_adapter);
+
+    return TRUE;
+}
+
+static void bluez_stop_discovery(GDBusConnection *connection) {
+    if (provision_added_id) {
+        g_dbus_connection_signal_unsubscribe(connection, provision_added_id);
+        provision_added_id = 0;
+    }
+
+    if (provision_discovering) {
+        bluez_adapter_call(connection, "StopDiscovery", NULL);
+        provision_discovering = FALSE;
+        printf("Stopped LE discovery on %s\n", provision_adapter);
+    }
+}
+
+static void on_provision_connected(GObject *source, GAsyncResult *res,
+                                   gpointer user_data) {
+    GDBusConnection *connection = G_DBUS_CONNECTION(source);
+    gchar *device_path = user_data;
+    GError *error = NULL;
+    GVariant *ret;
+
+    ret = g_dbus_connection_call_finish(connection, res, &error);
+
+    /* Provisioning was cleaned up while we were connecting */
+    if (!provision_adopted) {
+        if (ret)
+            g_variant_unref(ret);
+        g_clear_error(&error);
+        g_free(device_path);
+        return;
+    }
+
+    if (error) {
+        printf("Error connecting device %s : %s\n", device_path, error->message);
+        g_error_free(error);
+        /* Give it another chance next time it advertises */
+        g_hash_table_remove(provision_adopted, device_path);
+        g_hash_table_remove(provision_owned, device_path);
+    } else {
+        g_variant_unref(ret);
+        provision_connected++;
+        printf("Connected %s ( %u/%u )\n", device_path, provision_connected,
+                                             provision_target);
+        if (provision_connected >= provision_target)
+            bluez_stop_discovery(connection);
+    }
+
+    g_free(device_path);
+}
+
+static void bluez_provision_adopt(GDBusConnection *connection,
+                                  const gchar *device_path) {
+    if (!provision_discovering || !bluez_on_provision_adapter(device_path) ||
+        g_hash_table_contains(provision_adopted, device_path))
+        return;
+
+    printf("Adopting %s\n", device_path);
+    g_hash_table_add(provision_adopted, g_strdup(device_path));
+    g_hash_table_add(provision_owned, g_strdup(device_path));
+
+    /* Asynchronous, so that all the tags in range connect concurrently */
+    g_dbus_connection_call(connection, "org.bluez", device_path,
+                           "org.bluez.Device1", "Connect", NULL, NULL,
+                           G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                           on_provision_connected, g_strdup(device_path));
+}
+
+static void on_provision_added(GDBusConnection *connection,
+                               const gchar *sender_name,
+                               const gchar *object_path,
+                               const gchar *interface_name,
+                               const gchar *signal_name, GVariant *parameters,
+                               gpointer user_data) {
+    GVariant *ifaces, *device, *uuids;
+    const gchar *path;
+
+    g_variant_get(parameters, "(&o@a{sa{sv}})", &path, &ifaces);
+
+    device = g_variant_lookup_value(ifaces, "org.bluez.Device1", NULL);
+    if (device) {
+        /* Our discovery filter may be merged with other clients' ones, so
+         * check the advertised services anyway */
+        uuids = g_variant_lookup_value(device, "UUIDs", G_VARIANT_TYPE("as"));
+        if (uuids) {
+            if (bluez_uuids_are_sensortag(uuids)) {
+                g_hash_table_add(provision_candidates, g_strdup(path));
+                bluez_provision_adopt(connection, path);
+            }
+            g_variant_unref(uuids);
+        }
+        g_variant_unref(device);
+    }
+
+    g_variant_unref(ifaces);
+}
+
+static void on_provision_device_changed(GDBusConnection *connection,
+                                        const gchar *sender_name,
+                                        const gchar *object_path,
+                                        const gchar *interface_name,
+                                        const gchar *signal_name,
+                                        GVariant *parameters,
+                                        gpointer user_data) {
+    GVariant *props, *val;
+    gboolean resolved;
+
+    props = g_variant_get_child_value(parameters, 1);
+
+    /* The advertised services of known devices can change */
+    val = g_variant_lookup_value(props, "UUIDs", G_VARIANT_TYPE("as"));
+    if (val) {
+        if (bluez_uuids_are_sensortag(val))
+            g_hash_table_add(provision_candidates, g_strdup(object_path));
+        else
+            g_hash_table_remove(provision_candidates, object_path);
+        g_variant_unref(val);
+    }
+
+    /* Known devices don't get added again, but their RSSI is updated when
+     * they advertise. Only look at the ones we know have the service, this
+     * is called for every advertisement of every device in range. */
+    val = g_variant_lookup_value(props, "RSSI", NULL);
+    if (val) {
+        if (g_hash_table_contains(provision_candidates, object_path))
+            bluez_provision_adopt(connection, object_path);
+        g_variant_unref(val);
+    }
+
+    val = g_variant_lookup_value(props, "ServicesResolved",
+                                 G_VARIANT_TYPE_BOOLEAN);
+    if (val) {
+        resolved = g_variant_get_boolean(val);
+        g_variant_unref(val);
+
+        if (resolved && !notification_charac &&
+            g_hash_table_contains(provision_adopted, object_path)) {
+            printf("Services resolved on %s\n", object_path);
+            bluez_setup_init(connection, object_path);
+        }
+    }
+
+    g_variant_unref(props);
+}
+
+gboolean bluez_provision(GDBusConnection *connection, guint target) {
+    gchar *resolved_path;
+
+    provision_target = target;
+    provision_connected = 0;
+    provision_adopted = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, NULL);
+    provision_owned = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            g_free, NULL);
+    provision_candidates = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, NULL);
+
+    resolved_path = bluez_provision_scan(connection);
+    if (!provision_adapter) {
+        printf("No bluetooth adapter found\n");
+        return FALSE;
+    }
+
+    provision_added_id = g_dbus_connection_signal_subscribe(connection,
+                                                            "org.bluez",
+                                                            "org.freedesktop.DBus.ObjectManager",
+                                                            "InterfacesAdded",
+                                                            "/",
+                                                            NULL,
+                                                            G_DBUS_SIGNAL_FLAGS_NONE,
+                                                            on_provision_added,
+                                                            NULL, NULL);
+
+    provision_props_id = g_dbus_connection_signal_subscribe(connection,
+                                                            "org.bluez",
+                                                            "org.freedesktop.DBus.Properties",
+                                                            "PropertiesChanged",
+                                                            NULL,
+                                                            "org.bluez.Device1",
+                                                            G_DBUS_SIGNAL_FLAGS_NONE,
+                                                            on_provision_device_changed,
+                                                            NULL, NULL);
+
+    if (resolved_path) {
+        bluez_setup_init(connection, resolved_path);
+        g_free(resolved_path);
+    }
+
+    if (provision_connected >= provision_target) {
+        printf("%u tags already connected\n", provision_connected);
+        bluez_stop_discovery(connection);
+        return TRUE;
+    }
+
+    return bluez_start_discovery(connection);
+}
+
+static void bluez_provision_cleanup(GDBusConnection *connection) {
+    GHashTableIter iter;
+    gpointer device_path;
+
+    bluez_stop_discovery(connection);
+
+    if (provision_props_id) {
+        g_dbus_connection_signal_unsubscribe(connection, provision_props_id);
+        provision_props_id = 0;
+    }
+
+    /* Tags that were connected before we started are left alone */
+    if (provision_owned) {
+        g_hash_table_iter_init(&iter, provision_owned);
+        while (g_hash_table_iter_next(&iter, &device_path, NULL))
+            if (g_strcmp0(device_path, notification_device_path))
+                bluez_device_disconnect(connection, device_path);
+
+        g_hash_table_destroy(provision_owned);
+        provision_owned = NULL;
+    }
+
+    if (provision_adopted) {
+        g_hash_table_destroy(provision_adopted);
+        provision_adopted = NULL;
+    }
+
+    if (provision_candidates) {
+        g_hash_table_destroy(provision_candidates);
+        provision_candidates = NULL;
+    }
+
+    g_free(provision_adapter);
+    provision_adapter = NULL;
+}
+
 gboolean bluez_setup(GDBusConnection *connection) {
-    return bluez_setup_init(connection);
+    return bluez_setup_init(connection, NULL);
 }
 
 void bluez_cleanup(GDBusConnection *connection) {
+    bluez_provision_cleanup(connection);
+
+    bluez_cleanup_sensors(connection);
+
     if (notification_charac) {
         if (!bluez_stop_notify(connection, notification_charac)) {
             printf("Error stopping notifications\n");
@@ -386,5 +1228,6 @@ void bluez_cleanup(GDBusConnection *connection) {
     if (notification_device_path) {
         bluez_device_disconnect(connection, notification_device_path);
         g_free(notification_device_path);
+        notification_device_path = NULL;
     }
 }
@@ -31,5 +31,10 @@
 
 gboolean bluez_setup(GDBusConnection *connection);
 
+/* Discovers the tags advertising the key press service and connects them,
+ * until target tags are connected. The first one is set up for key press
+ * events. */
+gboolean bluez_provision(GDBusConnection *connection, guint target);
+
 void bluez_cleanup(GDBusConnection *connection);
 #endif
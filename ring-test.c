@@ -0,0 +1,160 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Maxime Chevallier
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Tests the sensor ring reader paths : following the writer across the end of
+ * the records, skipping the samples lost by a slow reader, resetting a cursor
+ * ahead of head and noticing that the ring was destroyed.
+ *
+ * Each sample carries its sequence number in timestamp_ns so that the reader
+ * can tell which one it got.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sensor-ring.h"
+
+static void publish(struct sensor_ring *ring, uint64_t n) {
+    struct sensor_sample sample;
+
+    memset(&sample, 0, sizeof(sample));
+    sample.timestamp_ns = n;
+    sample.type = SENSOR_LIGHT;
+    sample.values[0] = n / 2.0;
+
+    sensor_ring_publish(ring, &sample);
+}
+
+/* Reads all the available samples, they must be first ... last */
+static int expect(struct sensor_ring *ring, uint64_t *cursor, uint64_t first,
+                  uint64_t last, const char *what) {
+    struct sensor_sample sample;
+    uint64_t n = first;
+    int ret;
+
+    while ((ret = sensor_ring_read(ring, cursor, &sample)) > 0) {
+        if (sample.timestamp_ns != n || sample.values[0] != n / 2.0) {
+            printf("FAIL : %s : got sample %llu, expected %llu\n", what,
+                   (unsigned long long)sample.timestamp_ns,
+                   (unsigned long long)n);
+            return 1;
+        }
+        n++;
+    }
+
+    if (ret < 0) {
+        printf("FAIL : %s : ring seen as destroyed\n", what);
+        return 1;
+    }
+
+    if (n != last + 1 || *cursor != last + 1) {
+        printf("FAIL : %s : stopped at %llu, cursor %llu, expected %llu\n",
+               what, (unsigned long long)n, (unsigned long long)*cursor,
+               (unsigned long long)last + 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct sensor_ring *writer, *reader;
+    struct sensor_sample sample;
+    uint64_t cursor, n = 0, i;
+    int ret = 0;
+
+    writer = sensor_ring_create();
+    if (!writer) {
+        printf("FAIL : cannot create the ring\n");
+        return 1;
+    }
+
+    reader = sensor_ring_open();
+    if (!reader) {
+        printf("FAIL : cannot open the ring\n");
+        sensor_ring_destroy(writer);
+        return 1;
+    }
+
+    cursor = sensor_ring_head(reader);
+    if (sensor_ring_read(reader, &cursor, &sample) != 0) {
+        printf("FAIL : empty ring returned a sample\n");
+        ret = 1;
+        goto out;
+    }
+
+    /* A reader keeping up follows the writer several times around */
+    for (i = 0; i < 3 * SENSOR_RING_SIZE / 100 + 1; i++) {
+        uint64_t first = n;
+
+        while (n < first + 100)
+            publish(writer, n++);
+
+        if (expect(reader, &cursor, first, n - 1, "wrap")) {
+            ret = 1;
+            goto out;
+        }
+    }
+
+    if (!sensor_ring_reader_ns(writer)) {
+        printf("FAIL : the reader left no heartbeat\n");
+        ret = 1;
+        goto out;
+    }
+
+    /* A reader that fell behind jumps to the oldest sample still there */
+    for (i = 0; i < SENSOR_RING_SIZE + 10; i++)
+        publish(writer, n++);
+
+    if (expect(reader, &cursor, n - SENSOR_RING_SIZE, n - 1, "overrun")) {
+        ret = 1;
+        goto out;
+    }
+
+    /* A cursor from a previous ring, ahead of head, starts over from the
+     * oldest sample */
+    cursor = n + 1000;
+    if (expect(reader, &cursor, n - SENSOR_RING_SIZE, n - 1, "cursor ahead")) {
+        ret = 1;
+        goto out;
+    }
+
+    /* Once the daemon destroyed the ring, readers are told to reopen it */
+    sensor_ring_destroy(writer);
+    writer = NULL;
+
+    if (sensor_ring_read(reader, &cursor, &sample) != -1) {
+        printf("FAIL : read on a destroyed ring did not return -1\n");
+        ret = 1;
+    }
+
+out:
+    sensor_ring_close(reader);
+    sensor_ring_destroy(writer);
+
+    if (!ret)
+        printf("PASS\n");
+
+    return ret;
+}
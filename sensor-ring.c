@@ -0,0 +1,300 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Maxime Chevallier
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file deals with the shared memory sensor ring, see sensor-ring.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sensor-ring.h"
+
+#define SENSOR_RING_BYTES (sizeof(struct sensor_ring_shm) + \
+                    SENSOR_RING_SIZE * sizeof(struct sensor_ring_record))
+
+struct sensor_ring {
+    struct sensor_ring_shm *shm;
+    /* NULL if this process could not map the heartbeat segment */
+    struct sensor_ring_heartbeat *heartbeat;
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/** ----------------------------------------------------------------------------
+ * Creates a new shm object, replacing any previous one. Readers of a previous
+ * run keep their mapping of the old object, they must not see it shrink under
+ * them.
+ */
+static void *shm_create(const char *name, size_t size, mode_t mode) {
+    void *addr;
+    int fd;
+
+    shm_unlink(name);
+
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, mode);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create shm %s: %m\n", name);
+        return NULL;
+    }
+
+    /* Don't let the umask restrict the mode */
+    if (fchmod(fd, mode) || ftruncate(fd, size)) {
+        fprintf(stderr, "Cannot setup shm %s: %m\n", name);
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Cannot map shm %s: %m\n", name);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    return addr;
+}
+
+static void *shm_map(const char *name, size_t size, int writable) {
+    struct stat st;
+    void *addr;
+    int fd;
+
+    fd = shm_open(name, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) || st.st_size < size) {
+        fprintf(stderr, "shm %s is too small\n", name);
+        close(fd);
+        return NULL;
+    }
+
+    addr = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                MAP_SHARED, fd, 0);
+    close(fd);
+
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+struct sensor_ring *sensor_ring_create(void) {
+    struct sensor_ring *ring;
+    struct sensor_ring_shm *shm;
+    struct timespec now;
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        return NULL;
+
+    /* Only the daemon writes samples */
+    ring->shm = shm_create(SENSOR_RING_NAME, SENSOR_RING_BYTES, 0644);
+    if (!ring->shm) {
+        free(ring);
+        return NULL;
+    }
+
+    /* Anybody may tell that they are reading, the worst they can do is to
+     * keep the sensors at their full rate */
+    ring->heartbeat = shm_create(SENSOR_RING_HEARTBEAT_NAME,
+                                 sizeof(struct sensor_ring_heartbeat), 0666);
+    if (!ring->heartbeat)
+        fprintf(stderr, "Readers won't be seen\n");
+    else
+        atomic_store_explicit(&ring->heartbeat->reader_ns, 0,
+                              memory_order_relaxed);
+
+    shm = ring->shm;
+    shm->version = SENSOR_RING_VERSION;
+    shm->size = SENSOR_RING_SIZE;
+    shm->record_size = sizeof(struct sensor_ring_record);
+    clock_gettime(CLOCK_REALTIME, &now);
+    shm->generation = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    atomic_store_explicit(&shm->head, 0, memory_order_relaxed);
+
+    /* Readers check the magic first, publish it once the header is valid */
+    atomic_store_explicit(&shm->magic, SENSOR_RING_MAGIC,
+                          memory_order_release);
+
+    return ring;
+}
+
+void sensor_ring_destroy(struct sensor_ring *ring) {
+    if (!ring)
+        return;
+
+    /* Tells the readers still mapping it that this ring is dead */
+    atomic_store_explicit(&ring->shm->magic, 0, memory_order_release);
+    munmap(ring->shm, SENSOR_RING_BYTES);
+    shm_unlink(SENSOR_RING_NAME);
+
+    if (ring->heartbeat) {
+        munmap(ring->heartbeat, sizeof(struct sensor_ring_heartbeat));
+        shm_unlink(SENSOR_RING_HEARTBEAT_NAME);
+    }
+
+    free(ring);
+}
+
+void sensor_ring_publish(struct sensor_ring *ring,
+                         const struct sensor_sample *sample) {
+    struct sensor_ring_shm *shm = ring->shm;
+    uint64_t words[SENSOR_SAMPLE_WORDS];
+    uint64_t n = atomic_load_explicit(&shm->head, memory_order_relaxed);
+    struct sensor_ring_record *rec = &shm->records[n & (SENSOR_RING_SIZE - 1)];
+    unsigned int i;
+
+    memcpy(words, sample, sizeof(words));
+
+    atomic_store_explicit(&rec->seq, 2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    for (i = 0; i < SENSOR_SAMPLE_WORDS; i++)
+        atomic_store_explicit(&rec->data[i], words[i], memory_order_relaxed);
+
+    atomic_store_explicit(&rec->seq, 2 * n + 2, memory_order_release);
+    atomic_store_explicit(&shm->head, n + 1, memory_order_release);
+}
+
+uint64_t sensor_ring_reader_ns(struct sensor_ring *ring) {
+    if (!ring->heartbeat)
+        return 0;
+
+    return atomic_load_explicit(&ring->heartbeat->reader_ns,
+                                memory_order_relaxed);
+}
+
+struct sensor_ring *sensor_ring_open(void) {
+    struct sensor_ring *ring;
+    struct sensor_ring_shm *shm;
+
+    shm = shm_map(SENSOR_RING_NAME, SENSOR_RING_BYTES, 0);
+    if (!shm) {
+        fprintf(stderr, "Cannot map shm %s: %m\n", SENSOR_RING_NAME);
+        return NULL;
+    }
+
+    if (atomic_load_explicit(&shm->magic, memory_order_acquire) !=
+                                                    SENSOR_RING_MAGIC ||
+        shm->version != SENSOR_RING_VERSION ||
+        shm->size != SENSOR_RING_SIZE ||
+        shm->record_size != sizeof(struct sensor_ring_record)) {
+        fprintf(stderr, "Incompatible sensor ring in %s\n", SENSOR_RING_NAME);
+        munmap(shm, SENSOR_RING_BYTES);
+        return NULL;
+    }
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        munmap(shm, SENSOR_RING_BYTES);
+        return NULL;
+    }
+
+    ring->shm = shm;
+    ring->heartbeat = shm_map(SENSOR_RING_HEARTBEAT_NAME,
+                              sizeof(struct sensor_ring_heartbeat), 1);
+
+    return ring;
+}
+
+void sensor_ring_close(struct sensor_ring *ring) {
+    if (!ring)
+        return;
+
+    munmap(ring->shm, SENSOR_RING_BYTES);
+    if (ring->heartbeat)
+        munmap(ring->heartbeat, sizeof(struct sensor_ring_heartbeat));
+    free(ring);
+}
+
+uint64_t sensor_ring_head(struct sensor_ring *ring) {
+    return atomic_load_explicit(&ring->shm->head, memory_order_acquire);
+}
+
+uint64_t sensor_ring_generation(struct sensor_ring *ring) {
+    return ring->shm->generation;
+}
+
+int sensor_ring_read(struct sensor_ring *ring, uint64_t *cursor,
+                     struct sensor_sample *sample) {
+    struct sensor_ring_shm *shm = ring->shm;
+    uint64_t words[SENSOR_SAMPLE_WORDS];
+    struct sensor_ring_record *rec;
+    uint64_t head, seq;
+    unsigned int i;
+
+    if (atomic_load_explicit(&shm->magic, memory_order_relaxed) !=
+                                                        SENSOR_RING_MAGIC)
+        return -1;
+
+    if (ring->heartbeat)
+        atomic_store_explicit(&ring->heartbeat->reader_ns, monotonic_ns(),
+                              memory_order_relaxed);
+
+    for (;;) {
+        head = atomic_load_explicit(&shm->head, memory_order_acquire);
+
+        /* Cursor from another generation of the ring, start over */
+        if (*cursor > head)
+            *cursor = head > SENSOR_RING_SIZE ? head - SENSOR_RING_SIZE : 0;
+
+        if (*cursor == head)
+            return 0;
+
+        if (head - *cursor > SENSOR_RING_SIZE)
+            *cursor = head - SENSOR_RING_SIZE;
+
+        rec = &shm->records[*cursor & (SENSOR_RING_SIZE - 1)];
+
+        seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+        if (seq != 2 * *cursor + 2) {
+            /* Overwritten or being overwritten : this sample is lost */
+            (*cursor)++;
+            continue;
+        }
+
+        for (i = 0; i < SENSOR_SAMPLE_WORDS; i++)
+            words[i] = atomic_load_explicit(&rec->data[i],
+                                            memory_order_relaxed);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&rec->seq, memory_order_relaxed) != seq) {
+            (*cursor)++;
+            continue;
+        }
+
+        memcpy(sample, words, sizeof(words));
+        (*cursor)++;
+        return 1;
+    }
+}
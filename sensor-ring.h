@@ -0,0 +1,134 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Maxime Chevallier
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Shared memory ring of decoded sensor samples.
+ *
+ * The daemon is the only writer of samples. Any number of local processes can
+ * map the ring and follow it with their own cursor. Each record is guarded
+ * by a sequence counter (seqlock) so readers never block the writer : a reader
+ * that got overtaken simply retries or skips ahead.
+ *
+ * Readers leave a timestamp in a second, small segment each time they poll the
+ * ring, this is how the daemon knows that someone is using the samples and
+ * that the sensors should run at their full rate. That segment is writable by
+ * everyone, so that the samples can stay read-only for the readers.
+ *
+ * This header does not depend on glib so that it can be used by consumers.
+ */
+
+#ifndef __SENSOR_RING_H__
+#define __SENSOR_RING_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* ring-test builds the ring with its own names, so that it does not replace
+ * the one of a running daemon */
+#ifndef SENSOR_RING_NAME
+#define SENSOR_RING_NAME    "/sensortag-hid"
+#define SENSOR_RING_HEARTBEAT_NAME "/sensortag-hid-readers"
+#endif
+#define SENSOR_RING_MAGIC   0x53544852  /* "STHR" */
+#define SENSOR_RING_VERSION 1
+
+/* Number of records, must be a power of 2 */
+#define SENSOR_RING_SIZE    1024
+
+enum sensor_type {
+    SENSOR_IR_TEMP = 0,     /* values : object temp (°C), ambient temp (°C) */
+    SENSOR_HUMIDITY,        /* values : temp (°C), relative humidity (%) */
+    SENSOR_PRESSURE,        /* values : temp (°C), pressure (hPa) */
+    SENSOR_LIGHT,           /* values : illuminance (lux), unused */
+    SENSOR_TYPE_COUNT,
+};
+
+struct sensor_sample {
+    uint64_t timestamp_ns;  /* CLOCK_MONOTONIC */
+    uint32_t type;          /* enum sensor_type */
+    uint32_t device;        /* index of the sensortag on this gateway */
+    double values[2];
+};
+
+#define SENSOR_SAMPLE_WORDS (sizeof(struct sensor_sample) / sizeof(uint64_t))
+
+struct sensor_ring_record {
+    /* 2n + 1 while record n is being written, 2n + 2 once it is complete */
+    _Atomic uint64_t seq;
+    _Atomic uint64_t data[SENSOR_SAMPLE_WORDS];
+} __attribute__((aligned(64)));
+
+/* Layout of the SENSOR_RING_NAME segment */
+struct sensor_ring_shm {
+    /* Cleared when the daemon destroys the ring */
+    _Atomic uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t record_size;
+    /* Changes each time the daemon creates the ring, CLOCK_REALTIME */
+    uint64_t generation;
+    /* Number of records written since the ring was created */
+    _Atomic uint64_t head;
+    struct sensor_ring_record records[] __attribute__((aligned(64)));
+};
+
+/* Layout of the SENSOR_RING_HEARTBEAT_NAME segment */
+struct sensor_ring_heartbeat {
+    /* Last time a reader polled the ring, CLOCK_MONOTONIC */
+    _Atomic uint64_t reader_ns;
+};
+
+/* Handle on the mapped segments, private to each process */
+struct sensor_ring;
+
+/* Writer side, used by the daemon */
+struct sensor_ring *sensor_ring_create(void);
+
+void sensor_ring_destroy(struct sensor_ring *ring);
+
+void sensor_ring_publish(struct sensor_ring *ring,
+                         const struct sensor_sample *sample);
+
+/* Last time a reader polled the ring, 0 if it never happened */
+uint64_t sensor_ring_reader_ns(struct sensor_ring *ring);
+
+/* Reader side. If the heartbeat segment cannot be mapped, the reader works but
+ * is not seen by the daemon. */
+struct sensor_ring *sensor_ring_open(void);
+
+void sensor_ring_close(struct sensor_ring *ring);
+
+/* Cursor to use to only get samples published from now on */
+uint64_t sensor_ring_head(struct sensor_ring *ring);
+
+/* Tells apart the rings created by successive runs of the daemon */
+uint64_t sensor_ring_generation(struct sensor_ring *ring);
+
+/* Returns 1 and advances the cursor if a sample was read, 0 if there is no new
+ * sample. If the reader fell behind by more than the ring size, the cursor
+ * jumps to the oldest sample still available. A cursor ahead of the ring
+ * ( taken from another generation ) is reset.
+ * Returns -1 if the daemon destroyed the ring : close it and open the new one. */
+int sensor_ring_read(struct sensor_ring *ring, uint64_t *cursor,
+                     struct sensor_sample *sample);
+
+#endif
@@ -28,7 +28,8 @@
  * HID events ( right and left key presses ).
  *
  * This is a demo software, using the BlueZ 5 DBus GATT API to get events, and
- * uhid to converts them into HID events.
+ * uhid to converts them into HID events. Optionally, the events can be read
+ * directly from an ATT socket, without going through bluetoothd.
  *
  * This file deals with the mainloop init, the DBus setup and cleanup.
  */
@@ -41,6 +42,7 @@
 #include <gio/gio.h>
 
 #include "bluez-gatt-client.h"
+#include "att-client.h"
 #include "uhid.h"
 
 #define BLUEZ_BUS_NAME "org.bluez"
@@ -49,6 +51,22 @@ static gint bluez_id = 0;
 GMainLoop *loop = NULL;
 GDBusConnection *dbus_connection = NULL;
 
+static gchar *att_address = NULL;
+static gchar *output = NULL;
+static gint provision = 0;
+
+static GOptionEntry options[] = {
+    { "att", 'a', 0, G_OPTION_ARG_STRING, &att_address,
+      "Connect directly to the sensortag at this address, without bluetoothd",
+      "ADDR" },
+    { "output", 'o', 0, G_OPTION_ARG_STRING, &output,
+      "HID output backend : uhid ( default ) or uinput", "BACKEND" },
+    { "provision", 'p', 0, G_OPTION_ARG_INT, &provision,
+      "Discover and connect new sensortags until N of them are connected",
+      "N" },
+    { NULL }
+};
+
 /**
  * Called at exit
  * */
@@ -64,6 +82,8 @@ void cleanup() {
         bluez_id = 0;
     }
 
+    att_cleanup();
+
     uhid_cleanup();
 
     if (loop && g_main_loop_is_running(loop))
@@ -79,7 +99,12 @@ static void on_bluez_appeared(GDBusConnection *connection, const gchar *name,
                                   const gchar *name_owner, gpointer user_data) {
 
     dbus_connection = connection;
-    if (!bluez_setup(connection)) {
+    if (provision > 0) {
+        if (!bluez_provision(connection, provision)) {
+            printf("Unable to start provisioning\n");
+            cleanup();
+        }
+    } else if (!bluez_setup(connection)) {
         printf("Unable to setup bluez watchers\n");
         cleanup();
     }
@@ -97,6 +122,21 @@ static void on_bluez_vanished(GDBusConnection *connection, const gchar *name,
 }
 
 int main(int argc, char **argv) {
+    GOptionContext *context;
+    GError *error = NULL;
+
+    context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (output && !uhid_select_backend(output))
+        return 1;
 
     if (atexit(cleanup)) {
         printf("Cannot register cleanup callback\n");
@@ -110,10 +150,23 @@ int main(int argc, char **argv) {
     }
 
     loop = g_main_loop_new(NULL, FALSE);
-    bluez_id = g_bus_watch_name(G_BUS_TYPE_SYSTEM, BLUEZ_BUS_NAME,
-                                G_BUS_NAME_WATCHER_FLAGS_AUTO_START,
-                                on_bluez_appeared, on_bluez_vanished,
-                                NULL, NULL);
+
+    if (att_address) {
+        if (!att_setup(att_address)) {
+            printf("Unable to setup ATT client\n");
+            return 1;
+        }
+
+        if (!uhid_init()) {
+            printf("Unable to init uhid\n");
+            return 1;
+        }
+    } else {
+        bluez_id = g_bus_watch_name(G_BUS_TYPE_SYSTEM, BLUEZ_BUS_NAME,
+                                    G_BUS_NAME_WATCHER_FLAGS_AUTO_START,
+                                    on_bluez_appeared, on_bluez_vanished,
+                                    NULL, NULL);
+    }
 
     g_main_loop_run(loop);
 
@@ -0,0 +1,231 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Maxime Chevallier
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Compares the output backends : for each of them, sends click / release
+ * pairs and reads them back from the evdev node the kernel created.
+ *
+ * Reports the CPU time spent in the backend per event ( this includes the
+ * kernel work done in the write, HID report parsing for uhid ), and the
+ * latency between the write and the evdev event, both as timestamped by the
+ * kernel and as seen by a reader.
+ *
+ * Needs root, like the daemon : sudo ./uhid-bench [nb_clicks]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <linux/input.h>
+
+#include "uhid.h"
+
+#define DEFAULT_CLICKS  10000
+#define EVDEV_WAIT_MS   5000
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t rusage_ns(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void print_distribution(const char *what, uint64_t *vals, size_t n) {
+    qsort(vals, n, sizeof(*vals), cmp_u64);
+    printf("  %-24s min %6.1f  p50 %6.1f  p99 %6.1f  max %7.1f us\n", what,
+           vals[0] / 1000.0, vals[n / 2] / 1000.0, vals[n * 99 / 100] / 1000.0,
+           vals[n - 1] / 1000.0);
+}
+
+/* udev may take a bit of time to create the node, retry until it shows up */
+static int open_evdev(const char *name) {
+    char dev_name[256];
+    glob_t g;
+    size_t i;
+    int fd, clk = CLOCK_MONOTONIC;
+    int waited;
+
+    for (waited = 0; waited < EVDEV_WAIT_MS; waited += 10) {
+        if (!glob("/dev/input/event*", 0, NULL, &g)) {
+            for (i = 0; i < g.gl_pathc; i++) {
+                fd = open(g.gl_pathv[i], O_RDONLY | O_CLOEXEC);
+                if (fd < 0)
+                    continue;
+
+                memset(dev_name, 0, sizeof(dev_name));
+                if (ioctl(fd, EVIOCGNAME(sizeof(dev_name) - 1), dev_name) >= 0 &&
+                    !strcmp(dev_name, name)) {
+                    globfree(&g);
+                    /* Get the event timestamps on the same clock as ours */
+                    if (ioctl(fd, EVIOCSCLOCKID, &clk))
+                        printf("Cannot set evdev clock : %m\n");
+                    return fd;
+                }
+                close(fd);
+            }
+            globfree(&g);
+        }
+        usleep(10000);
+    }
+
+    return -1;
+}
+
+/* Reads events until the SYN_REPORT, returns its kernel timestamp */
+static int read_report(int fd, uint64_t *ts) {
+    struct input_event ev;
+
+    for (;;) {
+        if (read(fd, &ev, sizeof(ev)) != sizeof(ev))
+            return -1;
+
+        if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+            *ts = ev.input_event_sec * 1000000000ULL +
+                  ev.input_event_usec * 1000ULL;
+            return 0;
+        }
+    }
+}
+
+static int bench(const char *name, const char *evdev_name, size_t nb_clicks) {
+    const struct uhid_backend *backend = uhid_get_backend(name);
+    size_t nb_events = 2 * nb_clicks;
+    uint64_t *cpu, *kernel_lat, *read_lat;
+    uint64_t start, t0, t1, ts, ru_start, wall_start, cpu_total = 0;
+    size_t i;
+    int fd, ret = -1;
+
+    if (!backend || !backend->init()) {
+        printf("%s : cannot create the device\n", name);
+        return -1;
+    }
+
+    fd = open_evdev(evdev_name);
+    if (fd < 0) {
+        printf("%s : no evdev node for %s\n", name, evdev_name);
+        backend->cleanup();
+        return -1;
+    }
+
+    /* The clicks are real ones : keep them from the display server and the
+     * console, only this reader gets them */
+    if (ioctl(fd, EVIOCGRAB, 1)) {
+        printf("%s : cannot grab %s : %m\n", name, evdev_name);
+        close(fd);
+        backend->cleanup();
+        return -1;
+    }
+
+    cpu = calloc(nb_events, sizeof(*cpu));
+    kernel_lat = calloc(nb_events, sizeof(*kernel_lat));
+    read_lat = calloc(nb_events, sizeof(*read_lat));
+    if (!cpu || !kernel_lat || !read_lat)
+        goto out;
+
+    ru_start = rusage_ns();
+    wall_start = clock_ns(CLOCK_MONOTONIC);
+
+    for (i = 0; i < nb_events; i++) {
+        /* Odd events release the button */
+        gboolean down = !(i & 1);
+
+        t0 = clock_ns(CLOCK_MONOTONIC);
+        start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+        if (!backend->event(down, FALSE)) {
+            printf("%s : cannot send event %zu\n", name, i);
+            goto out;
+        }
+        cpu[i] = clock_ns(CLOCK_THREAD_CPUTIME_ID) - start;
+
+        if (read_report(fd, &ts)) {
+            printf("%s : cannot read event %zu\n", name, i);
+            goto out;
+        }
+        t1 = clock_ns(CLOCK_MONOTONIC);
+
+        kernel_lat[i] = ts > t0 ? ts - t0 : 0;
+        read_lat[i] = t1 - t0;
+    }
+
+    for (i = 0; i < nb_events; i++)
+        cpu_total += cpu[i];
+
+    printf("%s : %zu events in %.1f ms, %.0f ns CPU per event in the backend "
+           "( %.0f ns with the evdev reads )\n", name, nb_events,
+           (clock_ns(CLOCK_MONOTONIC) - wall_start) / 1e6,
+           (double)cpu_total / nb_events,
+           (double)(rusage_ns() - ru_start) / nb_events);
+
+    print_distribution("backend CPU time", cpu, nb_events);
+    print_distribution("write -> evdev event", kernel_lat, nb_events);
+    print_distribution("write -> evdev read", read_lat, nb_events);
+
+    ret = 0;
+
+out:
+    free(cpu);
+    free(kernel_lat);
+    free(read_lat);
+    close(fd);
+    backend->cleanup();
+
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    size_t nb_clicks = DEFAULT_CLICKS;
+    int ret = 0;
+
+    if (argc > 1)
+        nb_clicks = strtoul(argv[1], NULL, 0);
+    if (!nb_clicks) {
+        printf("usage : %s [nb_clicks]\n", argv[0]);
+        return 1;
+    }
+
+    if (bench("uhid", "demo-sensortag-uhid", nb_clicks))
+        ret = 1;
+    if (bench("uinput", "demo-sensortag-uinput", nb_clicks))
+        ret = 1;
+
+    return ret;
+}
@@ -35,6 +35,7 @@
 #include <string.h>
 #include <unistd.h>
 #include "uhid.h"
+#include "uinput.h"
 
 static int dev_fd = -1;
 
@@ -126,12 +127,11 @@ static int send_event(int fd, int left_down, int right_down) {
     return uhid_write(fd, &ev);
 }
 
-gboolean uhid_event(gboolean left_down, gboolean right_down) {
+static gboolean uhid_dev_event(gboolean left_down, gboolean right_down) {
     if (dev_fd < 0) {
         printf("uhid not initialized\n");
         return FALSE;
     } else {
-        printf("event : left:%d right:%d\n", left_down, right_down);
         if (send_event(dev_fd, left_down, right_down)) {
             printf("Cannot send event\n");
             return FALSE;
@@ -140,7 +140,7 @@ gboolean uhid_event(gboolean left_down, gboolean right_down) {
     }
 }
 
-gboolean uhid_init() {
+static gboolean uhid_dev_init(void) {
     const char *path = "/dev/uhid";
     int fd = fd = open(path, O_RDWR | O_CLOEXEC);
     if (fd < 0) {
@@ -159,10 +159,61 @@ gboolean uhid_init() {
     return TRUE;
 }
 
-gboolean uhid_cleanup() {
+static gboolean uhid_dev_cleanup(void) {
     if (dev_fd >= 0) {
         destroy(dev_fd);
+        close(dev_fd);
         dev_fd = -1;
     }
     return TRUE;
 }
+
+static const struct uhid_backend uhid_dev_backend = {
+    .name = "uhid",
+    .init = uhid_dev_init,
+    .event = uhid_dev_event,
+    .cleanup = uhid_dev_cleanup,
+};
+
+static const struct uhid_backend *backends[] = {
+    &uhid_dev_backend,
+    &uinput_backend,
+};
+
+static const struct uhid_backend *backend = &uhid_dev_backend;
+
+const struct uhid_backend *uhid_get_backend(const gchar *name) {
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(backends); i++)
+        if (!g_strcmp0(backends[i]->name, name))
+            return backends[i];
+
+    return NULL;
+}
+
+gboolean uhid_select_backend(const gchar *name) {
+    const struct uhid_backend *b = uhid_get_backend(name);
+
+    if (!b) {
+        printf("Unknown output backend %s\n", name);
+        return FALSE;
+    }
+
+    backend = b;
+    return TRUE;
+}
+
+gboolean uhid_event(gboolean left_down, gboolean right_down) {
+    printf("event : left:%d right:%d\n", left_down, right_down);
+    return backend->event(left_down, right_down);
+}
+
+gboolean uhid_init() {
+    printf("Using %s output\n", backend->name);
+    return backend->init();
+}
+
+gboolean uhid_cleanup() {
+    return backend->cleanup();
+}
@@ -27,6 +27,21 @@
 
 #include <gio/gio.h>
 
+/* HID output backend. uhid_init(), uhid_event() and uhid_cleanup() go through
+ * the selected one, /dev/uhid by default. */
+struct uhid_backend {
+    const gchar *name;
+    gboolean (*init)(void);
+    gboolean (*event)(gboolean left_down, gboolean right_down);
+    gboolean (*cleanup)(void);
+};
+
+/* Returns NULL for unknown backends */
+const struct uhid_backend *uhid_get_backend(const gchar *name);
+
+/* Must be called before uhid_init(). Returns FALSE for unknown backends */
+gboolean uhid_select_backend(const gchar *name);
+
 gboolean uhid_event(gboolean left_down, gboolean right_down);
 
 gboolean uhid_init();
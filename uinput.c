@@ -0,0 +1,139 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Maxime Chevallier
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+#include "uinput.h"
+
+static int uinput_fd = -1;
+static gboolean prev_left = FALSE;
+static gboolean prev_right = FALSE;
+
+static void set_event(struct input_event *ev, int type, int code, int value) {
+    memset(ev, 0, sizeof(*ev));
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+}
+
+static gboolean uinput_event(gboolean left_down, gboolean right_down) {
+    struct input_event ev[3];
+    ssize_t ret;
+    int n = 0;
+
+    if (uinput_fd < 0) {
+        printf("uinput not initialized\n");
+        return FALSE;
+    }
+
+    /* Only report the buttons that changed, evdev would filter the others */
+    if (left_down != prev_left)
+        set_event(&ev[n++], EV_KEY, BTN_LEFT, left_down);
+    if (right_down != prev_right)
+        set_event(&ev[n++], EV_KEY, BTN_RIGHT, right_down);
+
+    if (!n)
+        return TRUE;
+
+    set_event(&ev[n++], EV_SYN, SYN_REPORT, 0);
+
+    /* The whole batch in one write, so one syscall per event */
+    ret = write(uinput_fd, ev, n * sizeof(ev[0]));
+    if (ret != (ssize_t)(n * sizeof(ev[0]))) {
+        printf("Cannot send event : %m\n");
+        return FALSE;
+    }
+
+    prev_left = left_down;
+    prev_right = right_down;
+
+    return TRUE;
+}
+
+static gboolean uinput_init(void) {
+    const char *path = "/dev/uinput";
+    struct uinput_setup setup;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        printf("Cannot open %s\n", path);
+        return FALSE;
+    }
+
+    /* Same capabilities as the uhid report descriptor : 3 buttons and
+     * X, Y, wheel relative axes, so that we are seen as a mouse */
+    if (ioctl(fd, UI_SET_EVBIT, EV_KEY) ||
+        ioctl(fd, UI_SET_KEYBIT, BTN_LEFT) ||
+        ioctl(fd, UI_SET_KEYBIT, BTN_RIGHT) ||
+        ioctl(fd, UI_SET_KEYBIT, BTN_MIDDLE) ||
+        ioctl(fd, UI_SET_EVBIT, EV_REL) ||
+        ioctl(fd, UI_SET_RELBIT, REL_X) ||
+        ioctl(fd, UI_SET_RELBIT, REL_Y) ||
+        ioctl(fd, UI_SET_RELBIT, REL_WHEEL)) {
+        printf("Cannot set uinput capabilities : %m\n");
+        close(fd);
+        return FALSE;
+    }
+
+    memset(&setup, 0, sizeof(setup));
+    strcpy(setup.name, "demo-sensortag-uinput");
+    setup.id.bustype = BUS_USB;
+    setup.id.vendor = 0x15d9;
+    setup.id.product = 0x0a37;
+    setup.id.version = 0;
+
+    if (ioctl(fd, UI_DEV_SETUP, &setup) || ioctl(fd, UI_DEV_CREATE)) {
+        printf("Cannot initialize uinput dev : %m\n");
+        close(fd);
+        return FALSE;
+    }
+
+    prev_left = FALSE;
+    prev_right = FALSE;
+    uinput_fd = fd;
+
+    return TRUE;
+}
+
+static gboolean uinput_cleanup(void) {
+    if (uinput_fd >= 0) {
+        ioctl(uinput_fd, UI_DEV_DESTROY);
+        close(uinput_fd);
+        uinput_fd = -1;
+    }
+    return TRUE;
+}
+
+const struct uhid_backend uinput_backend = {
+    .name = "uinput",
+    .init = uinput_init,
+    .event = uinput_event,
+    .cleanup = uinput_cleanup,
+};